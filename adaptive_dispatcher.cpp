@@ -0,0 +1,159 @@
+/*
+ * Fledge "scale" filter plugin.
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ */
+#include <adaptive_dispatcher.h>
+#include <logger.h>
+#include <thread>
+#include <string.h>
+
+using namespace std;
+
+const unsigned int AdaptiveDispatcher::DISPATCH_BUCKETS;
+const unsigned int AdaptiveDispatcher::DISPATCH_STRATEGIES;
+const unsigned int AdaptiveDispatcher::MIN_SAMPLES;
+const unsigned int AdaptiveDispatcher::EXPLORE_PERIOD;
+const unsigned int AdaptiveDispatcher::MIN_THREADED_BATCH;
+const unsigned int AdaptiveDispatcher::MAX_THREADS;
+
+/**
+ * Construct the dispatcher
+ *
+ * @param name	The name of the filter instance, used when logging
+ * @param threads	The number of threads to use when scaling with
+ *			multiple threads, 0 to use one per core
+ */
+AdaptiveDispatcher::AdaptiveDispatcher(const string& name, unsigned int threads) :
+	m_name(name), m_threads(threads)
+{
+	if (m_threads == 0)
+		m_threads = thread::hardware_concurrency();
+	if (m_threads > MAX_THREADS)
+		m_threads = MAX_THREADS;
+	reset();
+}
+
+/**
+ * Forget all the timings recorded so far
+ */
+void AdaptiveDispatcher::reset()
+{
+	lock_guard<mutex> guard(m_mutex);
+	memset(m_buckets, 0, sizeof(m_buckets));
+}
+
+/**
+ * Return the name of a strategy for logging
+ *
+ * @param strategy	The strategy
+ */
+const char *AdaptiveDispatcher::strategyName(Strategy strategy)
+{
+	return strategy == THREADED ? "threaded" : "inline";
+}
+
+/**
+ * Return the bucket for a batch size, the index of its highest set bit
+ *
+ * @param batchSize	The number of readings in the batch
+ */
+unsigned int AdaptiveDispatcher::bucket(size_t batchSize) const
+{
+	unsigned int b = 0;
+	while (batchSize > 1 && b < DISPATCH_BUCKETS - 1)
+	{
+		batchSize >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/**
+ * Can a strategy be used at all for a batch of this size
+ *
+ * @param strategy	The strategy
+ * @param batchSize	The number of readings in the batch
+ */
+bool AdaptiveDispatcher::available(Strategy strategy, size_t batchSize) const
+{
+	if (strategy == THREADED)
+		return m_threads > 1 && batchSize >= MIN_THREADED_BATCH;
+	return true;
+}
+
+/**
+ * Choose the strategy to use for a batch of readings
+ *
+ * @param batchSize	The number of readings in the batch
+ * @return		The strategy to use
+ */
+AdaptiveDispatcher::Strategy AdaptiveDispatcher::choose(size_t batchSize)
+{
+	if (!available(THREADED, batchSize))
+		return INLINE;
+
+	lock_guard<mutex> guard(m_mutex);
+	BUCKET& b = m_buckets[bucket(batchSize)];
+	b.batches++;
+
+	// Time every strategy a few times before deciding
+	for (unsigned int s = 0; s < DISPATCH_STRATEGIES; s++)
+	{
+		if (b.samples[s] < MIN_SAMPLES)
+			return (Strategy)s;
+	}
+
+	if (b.decided && b.batches % EXPLORE_PERIOD == 0)
+	{
+		// Occasionally retry the strategy not chosen in case costs have changed
+		return b.chosen == INLINE ? THREADED : INLINE;
+	}
+	return b.chosen;
+}
+
+/**
+ * Record the time taken to scale a batch of readings
+ *
+ * @param batchSize	The number of readings in the batch
+ * @param strategy	The strategy that was used
+ * @param nanoseconds	The time taken to scale the batch
+ */
+void AdaptiveDispatcher::record(size_t batchSize, Strategy strategy, double nanoseconds)
+{
+	if (batchSize == 0 || !available(THREADED, batchSize))
+		return;
+
+	lock_guard<mutex> guard(m_mutex);
+	unsigned int index = bucket(batchSize);
+	BUCKET& b = m_buckets[index];
+	double cost = nanoseconds / batchSize;
+	if (b.samples[strategy] == 0)
+		b.cost[strategy] = cost;
+	else
+		b.cost[strategy] = 0.75 * b.cost[strategy] + 0.25 * cost;
+	b.samples[strategy]++;
+
+	for (unsigned int s = 0; s < DISPATCH_STRATEGIES; s++)
+	{
+		if (b.samples[s] < MIN_SAMPLES)
+			return;
+	}
+
+	Strategy best = b.cost[THREADED] < b.cost[INLINE] ? THREADED : INLINE;
+	if (!b.decided || best != b.chosen)
+	{
+		b.chosen = best;
+		b.decided = true;
+		// The last bucket takes every batch too large for the others
+		string range = index == DISPATCH_BUCKETS - 1 ?
+			to_string(1UL << index) + " or more" :
+			to_string(1UL << index) + " to " + to_string((2UL << index) - 1);
+		Logger::getLogger()->info("Scale filter %s: batches of %s readings now use the %s strategy, "
+				"%.1f ns per reading inline, %.1f ns per reading with %u threads",
+				m_name.c_str(), range.c_str(),
+				strategyName(best), b.cost[INLINE], b.cost[THREADED], m_threads);
+	}
+}
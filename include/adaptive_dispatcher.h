@@ -0,0 +1,58 @@
+#ifndef _ADAPTIVE_DISPATCHER_H
+#define _ADAPTIVE_DISPATCHER_H
+/*
+ * Fledge "scale" filter plugin.
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ */
+#include <string>
+#include <mutex>
+
+/**
+ * Choose the cheapest way to scale a batch of readings based upon
+ * timings of previous batches of a similar size.
+ *
+ * Batches are grouped into power of two size buckets. Each bucket first
+ * tries every strategy a few times, then uses the one with the lowest
+ * average cost per reading, occasionally trying the others again in case
+ * the costs have changed. A change of strategy for a bucket is logged.
+ */
+class AdaptiveDispatcher {
+	public:
+		enum Strategy { INLINE = 0, THREADED = 1 };
+
+		static const unsigned int	DISPATCH_BUCKETS = 24;		// Power of two batch size buckets
+		static const unsigned int	DISPATCH_STRATEGIES = 2;
+		static const unsigned int	MIN_SAMPLES = 3;		// Timings of each strategy before deciding
+		static const unsigned int	EXPLORE_PERIOD = 64;		// Retry other strategies every this many batches
+		static const unsigned int	MIN_THREADED_BATCH = 64;	// Smallest batch worth splitting across threads
+		static const unsigned int	MAX_THREADS = 8;
+
+		AdaptiveDispatcher(const std::string& name, unsigned int threads = 0);
+		Strategy	choose(size_t batchSize);
+		void		record(size_t batchSize, Strategy strategy, double nanoseconds);
+		void		reset();
+		unsigned int	threads() const { return m_threads; };
+		static const char
+				*strategyName(Strategy strategy);
+	private:
+		typedef struct {
+			double		cost[DISPATCH_STRATEGIES];	// Average nanoseconds per reading
+			unsigned int	samples[DISPATCH_STRATEGIES];
+			unsigned long	batches;
+			Strategy	chosen;
+			bool		decided;
+		} BUCKET;
+
+		unsigned int	bucket(size_t batchSize) const;
+		bool		available(Strategy strategy, size_t batchSize) const;
+
+		const std::string	m_name;
+		unsigned int		m_threads;
+		BUCKET			m_buckets[DISPATCH_BUCKETS];
+		std::mutex		m_mutex;
+};
+
+#endif
@@ -13,12 +13,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <math.h>
+#include <limits.h>
 #include <string>
 #include <iostream>
 #include <filter_plugin.h>
 #include <filter.h>
 #include <reading_set.h>
+#include <logger.h>
 #include <regex>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <system_error>
+#include <sys/time.h>
+#include <adaptive_dispatcher.h>
 #include <version.h>
 
 #define FILTER_NAME "scale"
@@ -42,7 +52,31 @@
 			"\"match\" : {\"description\" : \"An optional regular expression to match in the asset name.\", " \
 				"\"type\": \"string\", " \
 				"\"default\": \"\", " \
-				"\"order\": \"3\", \"displayName\": \"Asset filter\"} }"
+				"\"order\": \"3\", \"displayName\": \"Asset filter\"}, " \
+			"\"decimation\" : {\"description\" : \"Keep only every Nth reading of each matching asset. " \
+					"A value of 1 keeps every reading.\", " \
+				"\"type\": \"integer\", " \
+				"\"default\": \"1\", \"minimum\": \"1\", " \
+				"\"order\": \"4\", \"displayName\": \"Decimation\"}, " \
+			"\"minInterval\" : {\"description\" : \"The minimum interval in milliseconds between " \
+					"two readings of the same matching asset. Readings that arrive sooner are discarded. " \
+					"A value of 0 disables the check.\", " \
+				"\"type\": \"integer\", " \
+				"\"default\": \"0\", \"minimum\": \"0\", " \
+				"\"order\": \"5\", \"displayName\": \"Minimum Interval (ms)\"}, " \
+			"\"precision\" : {\"description\" : \"The arithmetic used to scale values. High precision " \
+					"keeps full precision for integers beyond 2^53 at some extra cost. It also " \
+					"returns whole number results of integers as integers and fractional " \
+					"results as floats, where Standard does the reverse.\", " \
+				"\"type\": \"enumeration\", " \
+				"\"options\": [ \"Standard\", \"High\" ], " \
+				"\"default\": \"Standard\", " \
+				"\"order\": \"6\", \"displayName\": \"Precision\"}, " \
+			"\"adaptive\" : {\"description\" : \"Time the scaling of each batch of readings and use " \
+					"the fastest of inline or multi-threaded scaling for each batch size.\", " \
+				"\"type\": \"boolean\", " \
+				"\"default\": \"false\", " \
+				"\"order\": \"7\", \"displayName\": \"Adaptive Execution\"} }"
 using namespace std;
 
 /**
@@ -62,12 +96,288 @@ static PLUGIN_INFORMATION info = {
 	DEFAULT_CONFIG	          // Default plugin configuration
 };
 
+/**
+ * Per asset decimation state
+ */
+typedef struct
+{
+	unsigned long	seen;		// Number of readings seen for the asset
+	bool		kept;		// A reading has been kept for the asset
+	struct timeval	lastKept;	// User timestamp of the last reading kept
+} DECIMATION_STATE;
+
 typedef struct
 {
 	FledgeFilter	*handle;
 	std::string	configCatName;
+	std::map<std::string, DECIMATION_STATE>
+			decimation;
+	std::mutex	decimationMutex;
+	AdaptiveDispatcher
+			*dispatcher;
 } FILTER_INFO;
 
+/**
+ * Scale an integer value without first converting it to a double, so
+ * that integers beyond 2^53, such as 64 bit counters, keep their
+ * precision. Integral scale factors and offsets are applied using exact
+ * 128 bit arithmetic where available, anything else uses a single
+ * rounding long double fused multiply-add. An exact integer result that
+ * fits in a long is stored as an integer, otherwise the result is
+ * stored as a float. This is the reverse of the standard precision
+ * type rule, which stores whole numbers as floats and truncates
+ * fractional results to integers.
+ *
+ * @param value		The value to scale
+ * @param scaleFactor	The scale factor to apply
+ * @param offset	The offset to add after scaling
+ */
+static void scaleIntegerPrecise(DatapointValue& value, double scaleFactor, double offset)
+{
+	long input = value.toInt();
+#ifdef __SIZEOF_INT128__
+	if (scaleFactor == floor(scaleFactor) && fabs(scaleFactor) < 9.2e18
+		&& offset == floor(offset) && fabs(offset) < 9.2e18)
+	{
+		__int128 result = (__int128)input * (long)scaleFactor + (long)offset;
+		if (result >= LONG_MIN && result <= LONG_MAX)
+		{
+			value.setValue((long)result);
+			return;
+		}
+	}
+#endif
+	long double result = fmal((long double)input, (long double)scaleFactor, (long double)offset);
+	if (result == floorl(result)
+		&& result >= (long double)LONG_MIN && result < -(long double)LONG_MIN)
+	{
+		value.setValue((long)result);
+	}
+	else
+	{
+		value.setValue((double)result);
+	}
+}
+
+/**
+ * Apply the scale factor and offset to the numeric datapoints of a reading
+ *
+ * @param reading	The reading to scale
+ * @param scaleFactor	The scale factor to apply
+ * @param offset	The offset to add after scaling
+ * @param highPrecision	Use the high precision arithmetic
+ */
+static void scaleReading(Reading *reading, double scaleFactor, double offset, bool highPrecision)
+{
+	// Get a reading DataPoint
+	const vector<Datapoint *>& dataPoints = reading->getReadingData();
+	// Iterate over the datapoints
+	for (vector<Datapoint *>::const_iterator it = dataPoints.begin(); it != dataPoints.end(); ++it)
+	{
+		// Get the reference to a DataPointValue
+		DatapointValue& value = (*it)->getData();
+
+		/*
+		 * Deal with the T_INTEGER and T_FLOAT types.
+		 * Try to preserve the type if possible but
+		 * if a flaoting point scale or offset is applied
+		 * then T_INTEGER values will turn into T_FLOAT.
+		 */
+		if (value.getType() == DatapointValue::T_INTEGER && highPrecision)
+		{
+			scaleIntegerPrecise(value, scaleFactor, offset);
+		}
+		else if (value.getType() == DatapointValue::T_INTEGER)
+		{
+			double newValue = value.toInt() * scaleFactor + offset;
+			if (newValue == floor(newValue))
+			{
+				value.setValue(newValue);
+			}
+			else
+			{
+				value.setValue((long)newValue);
+			}
+		}
+		else if (value.getType() == DatapointValue::T_FLOAT && highPrecision)
+		{
+			value.setValue(fma(value.toDouble(), scaleFactor, offset));
+		}
+		else if (value.getType() == DatapointValue::T_FLOAT)
+		{
+			value.setValue(value.toDouble() * scaleFactor + offset);
+		}
+		else
+		{
+			// do nothing
+		}
+	}
+}
+
+/**
+ * Scale a range of readings, the unit of work of each thread
+ * when the readings are scaled by multiple threads
+ *
+ * @param first		The first reading to scale
+ * @param last		One past the last reading to scale
+ * @param scaleFactor	The scale factor to apply
+ * @param offset	The offset to add after scaling
+ * @param highPrecision	Use the high precision arithmetic
+ */
+static void scaleReadings(Reading **first, Reading **last,
+			  double scaleFactor, double offset, bool highPrecision)
+{
+	for (Reading **reading = first; reading < last; reading++)
+	{
+		scaleReading(*reading, scaleFactor, offset, highPrecision);
+	}
+}
+
+/**
+ * Scale a batch of readings using the strategy chosen by the adaptive
+ * dispatcher and record the time it took so later batches of a similar
+ * size can use the fastest strategy.
+ *
+ * @param dispatcher	The adaptive dispatcher
+ * @param readings	The readings to scale
+ * @param scaleFactor	The scale factor to apply
+ * @param offset	The offset to add after scaling
+ * @param highPrecision	Use the high precision arithmetic
+ */
+static void scaleAdaptive(AdaptiveDispatcher *dispatcher, vector<Reading *>& readings,
+			  double scaleFactor, double offset, bool highPrecision)
+{
+	size_t count = readings.size();
+	if (count == 0)
+		return;
+	Reading **first = &readings[0];
+
+	AdaptiveDispatcher::Strategy strategy = dispatcher->choose(count);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	if (strategy == AdaptiveDispatcher::THREADED)
+	{
+		unsigned int nThreads = dispatcher->threads();
+		size_t chunk = (count + nThreads - 1) / nThreads;
+		// Reserved up front so adding a worker never reallocates
+		vector<thread> workers;
+		workers.reserve(nThreads);
+		// The calling thread scales the first chunk itself
+		size_t offs = chunk;
+		try
+		{
+			for (; offs < count; offs += chunk)
+			{
+				size_t end = offs + chunk < count ? offs + chunk : count;
+				workers.push_back(thread(scaleReadings, first + offs, first + end,
+							scaleFactor, offset, highPrecision));
+			}
+		}
+		catch (const system_error& e)
+		{
+			// Out of threads, scale the chunks not yet started here
+			Logger::getLogger()->warn("Scale filter unable to start a scaling thread: %s", e.what());
+			if (offs < count)
+			{
+				scaleReadings(first + offs, first + count, scaleFactor, offset, highPrecision);
+			}
+		}
+		scaleReadings(first, first + (chunk < count ? chunk : count),
+				scaleFactor, offset, highPrecision);
+		for (vector<thread>::iterator it = workers.begin(); it != workers.end(); ++it)
+		{
+			it->join();
+		}
+	}
+	else
+	{
+		scaleReadings(first, first + count, scaleFactor, offset, highPrecision);
+	}
+	chrono::nanoseconds elapsed = chrono::steady_clock::now() - start;
+	dispatcher->record(count, strategy, (double)elapsed.count());
+}
+
+/**
+ * Remove from the reading set the readings discarded by the decimation
+ * settings. Each asset that passes the asset filter is decimated
+ * independently, keeping every Nth reading and, if a minimum interval
+ * is set, dropping readings whose user timestamp is closer than that
+ * to the last reading kept for the asset.
+ *
+ * The result of the asset filter for each reading kept is returned so
+ * the scaling does not have to match the asset name a second time.
+ *
+ * The readings are compacted in a single pass and the discarded
+ * readings are freed, so they cost nothing further down the pipeline.
+ *
+ * @param info		The filter information
+ * @param readingSet	The readings to decimate
+ * @param every		Keep one reading out of every this many
+ * @param minInterval	Minimum interval between kept readings in milliseconds
+ * @param re		The asset filter, or NULL to decimate all assets
+ * @param matched	Set to whether each reading kept passed the asset filter
+ */
+static void decimate(FILTER_INFO *info, ReadingSet *readingSet,
+		     long every, long minInterval, regex *re,
+		     vector<bool>& matched)
+{
+	const vector<Reading *>& readings = readingSet->getAllReadings();
+	vector<Reading *> kept;
+	kept.reserve(readings.size());
+	matched.clear();
+	matched.reserve(readings.size());
+
+	lock_guard<mutex> guard(info->decimationMutex);
+	for (vector<Reading *>::const_iterator elem = readings.begin();
+						      elem != readings.end();
+						      ++elem)
+	{
+		const string& asset = (*elem)->getAssetName();
+		if (re && ! regex_match(asset, *re))
+		{
+			kept.push_back(*elem);
+			matched.push_back(false);
+			continue;
+		}
+
+		DECIMATION_STATE& state = info->decimation[asset];
+		bool keep = every <= 1 || (state.seen % every) == 0;
+		state.seen++;
+		if (keep && minInterval > 0)
+		{
+			struct timeval ts;
+			(*elem)->getUserTimestamp(&ts);
+			if (state.kept)
+			{
+				// Microseconds, so sub-millisecond gaps are not rounded up
+				long elapsed = (ts.tv_sec - state.lastKept.tv_sec) * 1000000
+					+ (ts.tv_usec - state.lastKept.tv_usec);
+				keep = elapsed >= minInterval * 1000;
+			}
+			if (keep)
+			{
+				state.lastKept = ts;
+			}
+		}
+		if (keep)
+		{
+			state.kept = true;
+			kept.push_back(*elem);
+			matched.push_back(true);
+		}
+		else
+		{
+			delete *elem;
+		}
+	}
+
+	if (kept.size() != readings.size())
+	{
+		// Empty the set without freeing the readings, then give it the survivors
+		readingSet->removeAll();
+		readingSet->append(kept);
+	}
+}
+
 /**
  * Return the information about this plugin
  */
@@ -102,6 +412,7 @@ PLUGIN_HANDLE plugin_init(ConfigCategory* config,
 					outHandle,
 					output);
 	info->configCatName = config->getName();
+	info->dispatcher = new AdaptiveDispatcher(info->configCatName);
 
 	return (PLUGIN_HANDLE)info;
 }
@@ -147,6 +458,34 @@ void plugin_ingest(PLUGIN_HANDLE *handle,
 		match = filter->getConfig().getValue("match");
 		re = new regex(match);
 	}
+	bool highPrecision = false;
+	if (filter->getConfig().itemExists("precision"))
+	{
+		highPrecision = filter->getConfig().getValue("precision").compare("High") == 0;
+	}
+	bool adaptive = false;
+	if (filter->getConfig().itemExists("adaptive"))
+	{
+		adaptive = filter->getConfig().getValue("adaptive").compare("true") == 0;
+	}
+	long every = 1;
+	if (filter->getConfig().itemExists("decimation"))
+	{
+		every = strtol(filter->getConfig().getValue("decimation").c_str(), NULL, 10);
+	}
+	long minInterval = 0;
+	if (filter->getConfig().itemExists("minInterval"))
+	{
+		minInterval = strtol(filter->getConfig().getValue("minInterval").c_str(), NULL, 10);
+	}
+
+	// Discard decimated readings before any scaling is done
+	bool decimated = every > 1 || minInterval > 0;
+	vector<bool> matched;
+	if (decimated)
+	{
+		decimate(info, (ReadingSet *)readingSet, every, minInterval, match.empty() ? NULL : re, matched);
+	}
 
 	// 1- We might need to transform the inout readings set: example
 	// ReadingSet* newReadings = scale_readings(scaleFactor, readingSet);
@@ -154,6 +493,9 @@ void plugin_ingest(PLUGIN_HANDLE *handle,
 	// Just get all the readings in the readingset
 	const vector<Reading *>& readings = ((ReadingSet *)readingSet)->getAllReadings();
 
+	// Readings to scale once the asset filter has been applied
+	vector<Reading *> toScale;
+
 	AssetTracker *tracker = AssetTracker::getAssetTracker();
 	// Iterate over the readings
 	for (vector<Reading *>::const_iterator elem = readings.begin();
@@ -164,49 +506,35 @@ void plugin_ingest(PLUGIN_HANDLE *handle,
 		{
 			tracker->addAssetTrackingTuple(info->configCatName, (*elem)->getAssetName(), string("Filter"));
 		}
-		if (!match.empty())
+		if (decimated)
 		{
-			string asset = (*elem)->getAssetName();
-			if (! regex_match(asset, *re))
+			// The asset filter has already been applied by the decimation
+			if (! matched[elem - readings.begin()])
 			{
 				continue;
 			}
 		}
-		// Get a reading DataPoint
-		const vector<Datapoint *>& dataPoints = (*elem)->getReadingData();
-		// Iterate over the datapoints
-		for (vector<Datapoint *>::const_iterator it = dataPoints.begin(); it != dataPoints.end(); ++it)
-		{
-			// Get the reference to a DataPointValue
-			DatapointValue& value = (*it)->getData();
-
-			/*
-			 * Deal with the T_INTEGER and T_FLOAT types.
-			 * Try to preserve the type if possible but
-			 * if a flaoting point scale or offset is applied
-			 * then T_INTEGER values will turn into T_FLOAT.
-			 */
-			if (value.getType() == DatapointValue::T_INTEGER)
-			{
-				double newValue = value.toInt() * scaleFactor + offset;
-				if (newValue == floor(newValue))
-				{
-					value.setValue(newValue);
-				}
-				else
-				{
-					value.setValue((long)newValue);
-				}
-			}
-			else if (value.getType() == DatapointValue::T_FLOAT)
-			{
-				value.setValue(value.toDouble() * scaleFactor + offset);
-			}
-			else
+		else if (!match.empty())
+		{
+			string asset = (*elem)->getAssetName();
+			if (! regex_match(asset, *re))
 			{
-				// do nothing
+				continue;
 			}
 		}
+		if (adaptive)
+		{
+			toScale.push_back(*elem);
+		}
+		else
+		{
+			scaleReading(*elem, scaleFactor, offset, highPrecision);
+		}
+	}
+
+	if (adaptive)
+	{
+		scaleAdaptive(info->dispatcher, toScale, scaleFactor, offset, highPrecision);
 	}
 
 	// 2- optionally free reading set
@@ -232,6 +560,13 @@ void plugin_reconfigure(PLUGIN_HANDLE *handle, const std::string& newConfig)
 	FILTER_INFO *info = (FILTER_INFO *)handle;
 	FledgeFilter* data = info->handle;
 	data->setConfig(newConfig);
+
+	// Restart decimation with the new settings
+	lock_guard<mutex> guard(info->decimationMutex);
+	info->decimation.clear();
+
+	// The timings recorded may not hold for the new settings
+	info->dispatcher->reset();
 }
 
 /**
@@ -240,6 +575,7 @@ void plugin_reconfigure(PLUGIN_HANDLE *handle, const std::string& newConfig)
 void plugin_shutdown(PLUGIN_HANDLE *handle)
 {
 	FILTER_INFO *info = (FILTER_INFO *) handle;
+	delete info->dispatcher;
 	delete info->handle;
 	delete info;
 }
@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+#include <adaptive_dispatcher.h>
+#include <string>
+
+using namespace std;
+
+#define BATCH	100	// A batch size large enough to use threads
+
+/**
+ * Time every strategy MIN_SAMPLES times for a batch size, threaded
+ * scaling costing threadedCost per reading and inline inlineCost
+ */
+static void sample(AdaptiveDispatcher& dispatcher, size_t batch, double inlineCost, double threadedCost)
+{
+	for (unsigned int i = 0; i < AdaptiveDispatcher::MIN_SAMPLES; i++)
+	{
+		ASSERT_EQ(dispatcher.choose(batch), AdaptiveDispatcher::INLINE);
+		dispatcher.record(batch, AdaptiveDispatcher::INLINE, inlineCost * batch);
+	}
+	for (unsigned int i = 0; i < AdaptiveDispatcher::MIN_SAMPLES; i++)
+	{
+		ASSERT_EQ(dispatcher.choose(batch), AdaptiveDispatcher::THREADED);
+		dispatcher.record(batch, AdaptiveDispatcher::THREADED, threadedCost * batch);
+	}
+}
+
+TEST(SCALE_DISPATCHER, SmallBatchInline)
+{
+	AdaptiveDispatcher dispatcher("test", 4);
+	for (unsigned int i = 0; i < 2 * AdaptiveDispatcher::MIN_SAMPLES; i++)
+	{
+		ASSERT_EQ(dispatcher.choose(AdaptiveDispatcher::MIN_THREADED_BATCH - 1), AdaptiveDispatcher::INLINE);
+		// Ignored, threads are never worthwhile for batches this small
+		dispatcher.record(AdaptiveDispatcher::MIN_THREADED_BATCH - 1, AdaptiveDispatcher::INLINE, 1000000.0);
+	}
+}
+
+TEST(SCALE_DISPATCHER, SingleThreadInline)
+{
+	AdaptiveDispatcher dispatcher("test", 1);
+	for (unsigned int i = 0; i < 2 * AdaptiveDispatcher::MIN_SAMPLES; i++)
+	{
+		ASSERT_EQ(dispatcher.choose(BATCH), AdaptiveDispatcher::INLINE);
+		dispatcher.record(BATCH, AdaptiveDispatcher::INLINE, 100.0 * BATCH);
+	}
+}
+
+TEST(SCALE_DISPATCHER, SampleThenChooseCheapest)
+{
+	AdaptiveDispatcher dispatcher("test", 4);
+	ASSERT_NO_FATAL_FAILURE(sample(dispatcher, BATCH, 100.0, 50.0));
+	ASSERT_EQ(dispatcher.choose(BATCH), AdaptiveDispatcher::THREADED);
+
+	// Other batch sizes are sampled separately
+	ASSERT_NO_FATAL_FAILURE(sample(dispatcher, 10 * BATCH, 50.0, 100.0));
+	ASSERT_EQ(dispatcher.choose(10 * BATCH), AdaptiveDispatcher::INLINE);
+	ASSERT_EQ(dispatcher.choose(BATCH), AdaptiveDispatcher::THREADED);
+}
+
+TEST(SCALE_DISPATCHER, Explore)
+{
+	AdaptiveDispatcher dispatcher("test", 4);
+	ASSERT_NO_FATAL_FAILURE(sample(dispatcher, BATCH, 100.0, 50.0));
+
+	// The batches counted so far are those sampled
+	for (unsigned int batch = 2 * AdaptiveDispatcher::MIN_SAMPLES + 1; batch <= 3 * AdaptiveDispatcher::EXPLORE_PERIOD; batch++)
+	{
+		AdaptiveDispatcher::Strategy strategy = dispatcher.choose(BATCH);
+		if (batch % AdaptiveDispatcher::EXPLORE_PERIOD == 0)
+		{
+			ASSERT_EQ(strategy, AdaptiveDispatcher::INLINE) << "batch " << batch;
+		}
+		else
+		{
+			ASSERT_EQ(strategy, AdaptiveDispatcher::THREADED) << "batch " << batch;
+		}
+		dispatcher.record(BATCH, strategy, (strategy == AdaptiveDispatcher::INLINE ? 100.0 : 50.0) * BATCH);
+	}
+}
+
+TEST(SCALE_DISPATCHER, ChangeStrategy)
+{
+	AdaptiveDispatcher dispatcher("test", 4);
+	ASSERT_NO_FATAL_FAILURE(sample(dispatcher, BATCH, 100.0, 50.0));
+	ASSERT_EQ(dispatcher.choose(BATCH), AdaptiveDispatcher::THREADED);
+
+	// Threaded scaling becomes much slower
+	for (int i = 0; i < 4; i++)
+	{
+		dispatcher.record(BATCH, AdaptiveDispatcher::THREADED, 1000.0 * BATCH);
+	}
+	ASSERT_EQ(dispatcher.choose(BATCH), AdaptiveDispatcher::INLINE);
+}
+
+TEST(SCALE_DISPATCHER, Reset)
+{
+	AdaptiveDispatcher dispatcher("test", 4);
+	ASSERT_NO_FATAL_FAILURE(sample(dispatcher, BATCH, 100.0, 50.0));
+	ASSERT_EQ(dispatcher.choose(BATCH), AdaptiveDispatcher::THREADED);
+
+	dispatcher.reset();
+	ASSERT_NO_FATAL_FAILURE(sample(dispatcher, BATCH, 50.0, 100.0));
+	ASSERT_EQ(dispatcher.choose(BATCH), AdaptiveDispatcher::INLINE);
+}
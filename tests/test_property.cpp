@@ -0,0 +1,656 @@
+#include <gtest/gtest.h>
+#include <plugin_api.h>
+#include <config_category.h>
+#include <filter_plugin.h>
+#include <filter.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <float.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <regex>
+#include <random>
+#include <algorithm>
+#include <reading.h>
+#include <reading_set.h>
+#include <adaptive_dispatcher.h>
+
+using namespace std;
+
+/*
+ * Property tests for the scale filter. For each random configuration
+ * a series of random reading sets is passed through plugin_ingest, so
+ * that adaptive execution tries every strategy and decimation carries
+ * on from one reading set to the next. The output of each is
+ * compared, value by value and type by type, with a simple reference
+ * implementation of the filter. Any change to the scaling code must
+ * leave the results bit for bit identical. High precision integer
+ * results are instead checked against the exact value, computed with
+ * big integers.
+ *
+ * Each run uses a new random seed, reported when a case fails. Set
+ * SCALE_PROPERTY_SEED to rerun the cases generated from that seed.
+ */
+
+extern "C" {
+	PLUGIN_INFORMATION *plugin_info();
+	void plugin_ingest(void *handle,
+                   READINGSET *readingSet);
+	PLUGIN_HANDLE plugin_init(ConfigCategory* config,
+			  OUTPUT_HANDLE *outHandle,
+			  OUTPUT_STREAM output);
+	void plugin_shutdown(PLUGIN_HANDLE *handle);
+	void Handler(void *handle, READINGSET *readings);
+};
+
+#define CASES_PER_RUN	10
+// Enough batches for adaptive execution to sample every strategy and decide
+#define BATCHES_PER_CASE	(2 * AdaptiveDispatcher::MIN_SAMPLES + 1)
+
+/**
+ * A datapoint as generated and as expected after scaling
+ */
+typedef struct
+{
+	string				name;
+	DatapointValue::dataTagType	type;
+	long				intValue;
+	double				floatValue;
+	string				strValue;
+	bool				highPrecision;	// Check against the exact value
+	long				input;		// The integer input if so
+} DP_SPEC;
+
+/**
+ * A reading as generated and as expected after scaling
+ */
+typedef struct
+{
+	string		asset;
+	long		timestamp;	// Milliseconds
+	vector<DP_SPEC>	datapoints;
+} READING_SPEC;
+
+/**
+ * The decimation state of the reference implementation
+ */
+typedef struct
+{
+	map<string, long>	seen;
+	map<string, long>	lastKept;
+} REFERENCE_STATE;
+
+/**
+ * A filter configuration, numeric settings held as the strings
+ * given to the filter so the reference parses exactly the same values
+ */
+typedef struct
+{
+	string	factor;
+	string	offset;
+	string	match;
+	string	precision;
+	long	decimation;
+	long	minInterval;
+	bool	adaptive;
+} CONFIG_SPEC;
+
+static string number(double value)
+{
+	char buf[40];
+	snprintf(buf, sizeof(buf), "%.17g", value);
+	return string(buf);
+}
+
+static string randomNumber(mt19937_64& rng)
+{
+	switch (rng() % 4)
+	{
+		case 0:
+			return number((long)(rng() % 21) - 10);
+		case 1:
+			return number(uniform_real_distribution<double>(-1000.0, 1000.0)(rng));
+		case 2:
+			return number(1.0 / (double)(rng() % 1000 + 1));
+		default:
+			return "0";
+	}
+}
+
+static CONFIG_SPEC randomConfig(mt19937_64& rng)
+{
+	const char *matches[] = { "", "asset[0-2]", "asset1", "nomatch" };
+	CONFIG_SPEC config;
+	config.factor = randomNumber(rng);
+	config.offset = randomNumber(rng);
+	config.match = matches[rng() % 4];
+	config.precision = rng() % 2 ? "High" : "Standard";
+	config.decimation = rng() % 2 ? 1 : rng() % 4 + 1;
+	config.minInterval = rng() % 3 ? 0 : (long)(rng() % 100);
+	config.adaptive = rng() % 2;
+	return config;
+}
+
+/**
+ * Generate a batch of random readings, mostly large enough to be scaled
+ * by multiple threads even after decimation and the asset filter
+ *
+ * @param rng		The random number generator
+ * @param timestamp	The timestamp of the last reading generated, updated
+ */
+static vector<READING_SPEC> randomReadings(mt19937_64& rng, long& timestamp)
+{
+	size_t count = rng() % 4 ? 8 * AdaptiveDispatcher::MIN_THREADED_BATCH
+					+ rng() % (2 * AdaptiveDispatcher::MIN_THREADED_BATCH)
+				 : rng() % 40;
+	vector<READING_SPEC> readings;
+	for (size_t i = 0; i < count; i++)
+	{
+		READING_SPEC reading;
+		reading.asset = "asset" + to_string(rng() % 5);
+		timestamp += rng() % 80;
+		reading.timestamp = timestamp;
+		int nDatapoints = rng() % 4 + 1;
+		for (int j = 0; j < nDatapoints; j++)
+		{
+			DP_SPEC dp;
+			dp.name = "dp" + to_string(j);
+			dp.intValue = 0;
+			dp.floatValue = 0.0;
+			dp.highPrecision = false;
+			dp.input = 0;
+			switch (rng() % 5)
+			{
+				case 0:
+					dp.type = DatapointValue::T_INTEGER;
+					dp.intValue = (long)(rng() % 2001) - 1000;
+					break;
+				case 1:
+					// Large counters beyond the precision of a double
+					dp.type = DatapointValue::T_INTEGER;
+					dp.intValue = (long)(rng() >> 2) * (rng() % 2 ? 1 : -1);
+					break;
+				case 2:
+				case 3:
+					dp.type = DatapointValue::T_FLOAT;
+					dp.floatValue = uniform_real_distribution<double>(-1e6, 1e6)(rng);
+					break;
+				default:
+					dp.type = DatapointValue::T_STRING;
+					dp.strValue = "string" + to_string(rng() % 100);
+					break;
+			}
+			reading.datapoints.push_back(dp);
+		}
+		readings.push_back(reading);
+	}
+	return readings;
+}
+
+static ReadingSet *buildReadingSet(const vector<READING_SPEC>& specs)
+{
+	vector<Reading *> *readings = new vector<Reading *>;
+	for (vector<READING_SPEC>::const_iterator it = specs.begin(); it != specs.end(); ++it)
+	{
+		vector<Datapoint *> datapoints;
+		for (vector<DP_SPEC>::const_iterator dp = it->datapoints.begin(); dp != it->datapoints.end(); ++dp)
+		{
+			if (dp->type == DatapointValue::T_INTEGER)
+			{
+				DatapointValue dpv(dp->intValue);
+				datapoints.push_back(new Datapoint(dp->name, dpv));
+			}
+			else if (dp->type == DatapointValue::T_FLOAT)
+			{
+				DatapointValue dpv(dp->floatValue);
+				datapoints.push_back(new Datapoint(dp->name, dpv));
+			}
+			else
+			{
+				DatapointValue dpv(dp->strValue);
+				datapoints.push_back(new Datapoint(dp->name, dpv));
+			}
+		}
+		Reading *reading = new Reading(it->asset, datapoints);
+		struct timeval tm;
+		tm.tv_sec = it->timestamp / 1000;
+		tm.tv_usec = (it->timestamp % 1000) * 1000;
+		reading->setUserTimestamp(tm);
+		readings->push_back(reading);
+	}
+	return new ReadingSet(readings);
+}
+
+/**
+ * A signed integer of any size, with just the arithmetic needed to
+ * compute input * factor + offset exactly
+ */
+class BigInt {
+	public:
+		BigInt(long value = 0) : m_negative(value < 0)
+		{
+			unsigned long mag = value < 0 ? -(unsigned long)value : (unsigned long)value;
+			while (mag)
+			{
+				m_mag.push_back((uint32_t)mag);
+				mag >>= 32;
+			}
+		};
+
+		BigInt operator*(const BigInt& rhs) const
+		{
+			BigInt result;
+			result.m_mag.assign(m_mag.size() + rhs.m_mag.size(), 0);
+			for (size_t i = 0; i < m_mag.size(); i++)
+			{
+				uint64_t carry = 0;
+				for (size_t j = 0; j < rhs.m_mag.size(); j++)
+				{
+					uint64_t t = (uint64_t)m_mag[i] * rhs.m_mag[j] + result.m_mag[i + j] + carry;
+					result.m_mag[i + j] = (uint32_t)t;
+					carry = t >> 32;
+				}
+				result.m_mag[i + rhs.m_mag.size()] = (uint32_t)carry;
+			}
+			result.m_negative = m_negative != rhs.m_negative;
+			result.trim();
+			return result;
+		};
+
+		BigInt operator<<(int bits) const
+		{
+			BigInt result;
+			result.m_negative = m_negative;
+			result.m_mag.assign(bits / 32, 0);
+			int shift = bits % 32;
+			uint32_t carry = 0;
+			for (size_t i = 0; i < m_mag.size(); i++)
+			{
+				result.m_mag.push_back((m_mag[i] << shift) | carry);
+				carry = shift ? m_mag[i] >> (32 - shift) : 0;
+			}
+			result.m_mag.push_back(carry);
+			result.trim();
+			return result;
+		};
+
+		BigInt operator+(const BigInt& rhs) const
+		{
+			BigInt result;
+			if (m_negative == rhs.m_negative)
+			{
+				result = addMagnitude(*this, rhs);
+				result.m_negative = m_negative;
+			}
+			else if (compareMagnitude(*this, rhs) >= 0)
+			{
+				result = subtractMagnitude(*this, rhs);
+				result.m_negative = m_negative;
+			}
+			else
+			{
+				result = subtractMagnitude(rhs, *this);
+				result.m_negative = rhs.m_negative;
+			}
+			result.trim();
+			return result;
+		};
+
+		BigInt operator-(const BigInt& rhs) const
+		{
+			BigInt negated = rhs;
+			negated.m_negative = !rhs.m_negative;
+			return *this + negated;
+		};
+
+		int compare(const BigInt& rhs) const
+		{
+			if (m_negative != rhs.m_negative)
+				return m_negative ? -1 : 1;
+			int c = compareMagnitude(*this, rhs);
+			return m_negative ? -c : c;
+		};
+
+		// The number of bits in the magnitude
+		int bits() const
+		{
+			if (m_mag.empty())
+				return 0;
+			int bits = (m_mag.size() - 1) * 32;
+			for (uint32_t top = m_mag.back(); top; top >>= 1)
+				bits++;
+			return bits;
+		};
+
+		bool lowBitsZero(int bits) const
+		{
+			for (int i = 0; i < bits && i < (int)m_mag.size() * 32; i++)
+			{
+				if (m_mag[i / 32] & (1U << (i % 32)))
+					return false;
+			}
+			return true;
+		};
+
+		string toString() const
+		{
+			string hex = m_negative ? "-0x" : "0x";
+			char buf[10];
+			for (size_t i = m_mag.size(); i > 0; i--)
+			{
+				snprintf(buf, sizeof(buf), i == m_mag.size() ? "%x" : "%08x", m_mag[i - 1]);
+				hex += buf;
+			}
+			return m_mag.empty() ? "0" : hex;
+		};
+
+	private:
+		void trim()
+		{
+			while (!m_mag.empty() && m_mag.back() == 0)
+				m_mag.pop_back();
+			if (m_mag.empty())
+				m_negative = false;
+		};
+
+		static int compareMagnitude(const BigInt& a, const BigInt& b)
+		{
+			if (a.m_mag.size() != b.m_mag.size())
+				return a.m_mag.size() < b.m_mag.size() ? -1 : 1;
+			for (size_t i = a.m_mag.size(); i > 0; i--)
+			{
+				if (a.m_mag[i - 1] != b.m_mag[i - 1])
+					return a.m_mag[i - 1] < b.m_mag[i - 1] ? -1 : 1;
+			}
+			return 0;
+		};
+
+		static BigInt addMagnitude(const BigInt& a, const BigInt& b)
+		{
+			BigInt result;
+			uint64_t carry = 0;
+			for (size_t i = 0; i < a.m_mag.size() || i < b.m_mag.size(); i++)
+			{
+				uint64_t t = carry;
+				if (i < a.m_mag.size())
+					t += a.m_mag[i];
+				if (i < b.m_mag.size())
+					t += b.m_mag[i];
+				result.m_mag.push_back((uint32_t)t);
+				carry = t >> 32;
+			}
+			result.m_mag.push_back((uint32_t)carry);
+			return result;
+		};
+
+		// a - b where the magnitude of a is not less than that of b
+		static BigInt subtractMagnitude(const BigInt& a, const BigInt& b)
+		{
+			BigInt result;
+			int64_t borrow = 0;
+			for (size_t i = 0; i < a.m_mag.size(); i++)
+			{
+				int64_t t = (int64_t)a.m_mag[i] - borrow - (i < b.m_mag.size() ? b.m_mag[i] : 0);
+				borrow = t < 0;
+				result.m_mag.push_back((uint32_t)(t + (borrow << 32)));
+			}
+			return result;
+		};
+
+		bool			m_negative;
+		vector<uint32_t>	m_mag;	// Least significant word first
+};
+
+/**
+ * Split a double into an integer mantissa and a power of two exponent
+ */
+static BigInt mantissa(double value, int& exponent)
+{
+	int e;
+	double fraction = frexp(value, &e);
+	exponent = e - 53;
+	return BigInt((long)ldexp(fraction, 53));
+}
+
+/**
+ * Check a high precision integer result against the exact value of
+ * input * factor + offset, computed with big integers rather than the
+ * arithmetic used by the filter.
+ *
+ * An exact value that is an integer in the range of a long must be
+ * returned as that integer. Otherwise an integer result must be within
+ * one long double unit in the last place of the exact value and a float
+ * result within one double unit in the last place.
+ */
+static void checkHighInteger(DatapointValue& value, long input, double factor, double offset)
+{
+	int ef, eo;
+	BigInt mf = mantissa(factor, ef);
+	BigInt mo = mantissa(offset, eo);
+
+	// The exact value is exact * 2^scale
+	int scale = min(min(ef, eo), 0);
+	BigInt exact = ((BigInt(input) * mf) << (ef - scale)) + (mo << (eo - scale));
+
+	bool integral = exact.lowBitsZero(-scale);
+	bool inRange = exact.compare(BigInt(LONG_MIN) << -scale) >= 0
+			&& exact.compare(BigInt(LONG_MAX) << -scale) <= 0;
+	if (integral && inRange)
+	{
+		ASSERT_EQ(value.getType(), DatapointValue::T_INTEGER) << "input " << input;
+		ASSERT_EQ((BigInt(value.toInt()) << -scale).compare(exact), 0)
+			<< "input " << input << " exact " << exact.toString()
+			<< " * 2^" << scale << " got " << value.toInt();
+	}
+	else if (value.getType() == DatapointValue::T_INTEGER)
+	{
+		BigInt error = exact - (BigInt(value.toInt()) << -scale);
+		ASSERT_LE(error.bits(), exact.bits() - LDBL_MANT_DIG)
+			<< "input " << input << " exact " << exact.toString()
+			<< " * 2^" << scale << " got " << value.toInt();
+	}
+	else
+	{
+		ASSERT_EQ(value.getType(), DatapointValue::T_FLOAT) << "input " << input;
+		int ed;
+		BigInt md = mantissa(value.toDouble(), ed);
+		int common = min(scale, ed);
+		BigInt error = (exact << (scale - common)) - (md << (ed - common));
+		ASSERT_LE(error.bits(), ed - common)
+			<< "input " << input << " exact " << exact.toString()
+			<< " * 2^" << scale << " got " << number(value.toDouble());
+	}
+}
+
+/**
+ * The reference implementation of the filter: decimate the matching
+ * assets, then scale the numeric datapoints of the matching assets
+ */
+static vector<READING_SPEC> reference(const CONFIG_SPEC& config, const vector<READING_SPEC>& input,
+					REFERENCE_STATE& state)
+{
+	double factor = strtod(config.factor.c_str(), NULL);
+	double offset = strtod(config.offset.c_str(), NULL);
+	bool high = config.precision.compare("High") == 0;
+	regex re(config.match);
+	map<string, long>& seen = state.seen;
+	map<string, long>& lastKept = state.lastKept;
+
+	vector<READING_SPEC> output;
+	for (vector<READING_SPEC>::const_iterator it = input.begin(); it != input.end(); ++it)
+	{
+		bool matched = config.match.empty() || regex_match(it->asset, re);
+		if (matched && (config.decimation > 1 || config.minInterval > 0))
+		{
+			bool keep = (seen[it->asset]++ % config.decimation) == 0;
+			if (keep && config.minInterval > 0)
+			{
+				if (lastKept.count(it->asset))
+				{
+					keep = it->timestamp - lastKept[it->asset] >= config.minInterval;
+				}
+				if (keep)
+				{
+					lastKept[it->asset] = it->timestamp;
+				}
+			}
+			if (!keep)
+			{
+				continue;
+			}
+		}
+
+		READING_SPEC reading = *it;
+		if (matched)
+		{
+			for (vector<DP_SPEC>::iterator dp = reading.datapoints.begin(); dp != reading.datapoints.end(); ++dp)
+			{
+				if (dp->type == DatapointValue::T_INTEGER && high)
+				{
+					dp->highPrecision = true;
+					dp->input = dp->intValue;
+				}
+				else if (dp->type == DatapointValue::T_INTEGER)
+				{
+					double value = dp->intValue * factor + offset;
+					if (value == floor(value))
+					{
+						dp->type = DatapointValue::T_FLOAT;
+						dp->floatValue = value;
+					}
+					else
+					{
+						dp->intValue = (long)value;
+					}
+				}
+				else if (dp->type == DatapointValue::T_FLOAT)
+				{
+					dp->floatValue = high ? fma(dp->floatValue, factor, offset)
+								: dp->floatValue * factor + offset;
+				}
+			}
+		}
+		output.push_back(reading);
+	}
+	return output;
+}
+
+/**
+ * Pass one batch of readings through the filter and compare the
+ * output with the reference implementation
+ */
+static void checkBatch(void *handle, const CONFIG_SPEC& spec, const vector<READING_SPEC>& input,
+			REFERENCE_STATE& state, ReadingSet *& outReadings)
+{
+	ReadingSet *readingSet = buildReadingSet(input);
+	plugin_ingest(handle, (READINGSET *)readingSet);
+	ASSERT_EQ(outReadings, readingSet);
+
+	vector<READING_SPEC> expected = reference(spec, input, state);
+	double factor = strtod(spec.factor.c_str(), NULL);
+	double offset = strtod(spec.offset.c_str(), NULL);
+	const vector<Reading *>& results = outReadings->getAllReadings();
+	ASSERT_EQ(results.size(), expected.size());
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		ASSERT_STREQ(results[i]->getAssetName().c_str(), expected[i].asset.c_str());
+		vector<Datapoint *> points = results[i]->getReadingData();
+		ASSERT_EQ(points.size(), expected[i].datapoints.size());
+		for (size_t j = 0; j < points.size(); j++)
+		{
+			const DP_SPEC& dp = expected[i].datapoints[j];
+			DatapointValue& value = points[j]->getData();
+			ASSERT_STREQ(points[j]->getName().c_str(), dp.name.c_str());
+			if (dp.highPrecision)
+			{
+				ASSERT_NO_FATAL_FAILURE(checkHighInteger(value, dp.input, factor, offset));
+				continue;
+			}
+			ASSERT_EQ(value.getType(), dp.type);
+			if (dp.type == DatapointValue::T_INTEGER)
+			{
+				ASSERT_EQ(value.toInt(), dp.intValue);
+			}
+			else if (dp.type == DatapointValue::T_FLOAT)
+			{
+				double actual = value.toDouble();
+				ASSERT_EQ(memcmp(&actual, &dp.floatValue, sizeof(double)), 0)
+					<< "expected " << number(dp.floatValue) << " got " << number(actual);
+			}
+			else
+			{
+				ASSERT_STREQ(value.toStringValue().c_str(), dp.strValue.c_str());
+			}
+		}
+	}
+
+	delete readingSet;
+}
+
+/**
+ * Pass a series of random batches of readings through one instance of
+ * the filter configured as given
+ */
+static void checkCase(const CONFIG_SPEC& spec, mt19937_64& rng)
+{
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory *config = new ConfigCategory("scale", info->config);
+	ASSERT_NE(config, (ConfigCategory *)NULL);
+	config->setItemsValueFromDefault();
+	config->setValue("factor", spec.factor);
+	config->setValue("offset", spec.offset);
+	config->setValue("match", spec.match);
+	config->setValue("precision", spec.precision);
+	config->setValue("decimation", to_string(spec.decimation));
+	config->setValue("minInterval", to_string(spec.minInterval));
+	config->setValue("adaptive", spec.adaptive ? "true" : "false");
+	config->setValue("enable", "true");
+	ReadingSet *outReadings = NULL;
+	void *handle = plugin_init(config, &outReadings, Handler);
+
+	REFERENCE_STATE state;
+	long timestamp = 1000000;
+	for (int batch = 0; batch < BATCHES_PER_CASE; batch++)
+	{
+		vector<READING_SPEC> readings = randomReadings(rng, timestamp);
+		SCOPED_TRACE("batch " + to_string(batch) + ", " + to_string(readings.size()) + " readings");
+		checkBatch(handle, spec, readings, state, outReadings);
+		if (::testing::Test::HasFatalFailure())
+		{
+			return;
+		}
+	}
+
+	plugin_shutdown((PLUGIN_HANDLE *)handle);
+	delete config;
+}
+
+TEST(SCALE_PROPERTY, MatchesReference)
+{
+	unsigned long seed = random_device()();
+	const char *env = getenv("SCALE_PROPERTY_SEED");
+	if (env)
+	{
+		seed = strtoul(env, NULL, 10);
+	}
+	mt19937_64 rng(seed);
+
+	for (int i = 0; i < CASES_PER_RUN; i++)
+	{
+		CONFIG_SPEC config = randomConfig(rng);
+		SCOPED_TRACE("seed " + to_string(seed) + " case " + to_string(i)
+				+ ": factor " + config.factor + ", offset " + config.offset
+				+ ", match '" + config.match + "', precision " + config.precision
+				+ ", decimation " + to_string(config.decimation)
+				+ ", minInterval " + to_string(config.minInterval)
+				+ ", adaptive " + (config.adaptive ? "true" : "false"));
+		checkCase(config, rng);
+		if (HasFatalFailure())
+		{
+			return;
+		}
+	}
+}
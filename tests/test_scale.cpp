@@ -19,6 +19,7 @@ extern "C" {
 	PLUGIN_HANDLE plugin_init(ConfigCategory* config,
 			  OUTPUT_HANDLE *outHandle,
 			  OUTPUT_STREAM output);
+	void plugin_reconfigure(PLUGIN_HANDLE *handle, const std::string& newConfig);
 	int called = 0;
 
 	void Handler(void *handle, READINGSET *readings)
@@ -440,3 +441,332 @@ TEST(SCALE, ScaleMatch)
 		}
 	}
 }
+
+TEST(SCALE, ScaleDecimate)
+{
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory *config = new ConfigCategory("scale", info->config);
+	ASSERT_NE(config, (ConfigCategory *)NULL);
+	config->setItemsValueFromDefault();
+	ASSERT_EQ(config->itemExists("decimation"), true);
+	config->setValue("factor", "2");
+	config->setValue("decimation", "3");
+	config->setValue("match", "test.*");
+	config->setValue("enable", "true");
+	ReadingSet *outReadings;
+	void *handle = plugin_init(config, &outReadings, Handler);
+	vector<Reading *> *readings = new vector<Reading *>;
+
+	for (long i = 0; i < 7; i++)
+	{
+		DatapointValue dpv(i);
+		readings->push_back(new Reading("test", new Datapoint("test", dpv)));
+		DatapointValue dpv1(i);
+		readings->push_back(new Reading("untouched", new Datapoint("test", dpv1)));
+	}
+
+	ReadingSet readingSet(readings);
+	plugin_ingest(handle, (READINGSET *)&readingSet);
+
+
+	vector<Reading *>results = outReadings->getAllReadings();
+	ASSERT_EQ(results.size(), 10);
+	vector<double> scaled;
+	int untouched = 0;
+	for (int j = 0; j < results.size(); j++)
+	{
+		Reading *out = results[j];
+		vector<Datapoint *> points = out->getReadingData();
+		ASSERT_EQ(points.size(), 1);
+		if (out->getAssetName().compare("test") == 0)
+		{
+			scaled.push_back(points[0]->getData().toDouble());
+		}
+		else
+		{
+			ASSERT_EQ(points[0]->getData().getType(), DatapointValue::T_INTEGER);
+			ASSERT_EQ(points[0]->getData().toInt(), untouched);
+			untouched++;
+		}
+	}
+	ASSERT_EQ(untouched, 7);
+	ASSERT_EQ(scaled.size(), 3);
+	ASSERT_EQ(scaled[0], 0.0);
+	ASSERT_EQ(scaled[1], 6.0);
+	ASSERT_EQ(scaled[2], 12.0);
+}
+
+TEST(SCALE, ScaleMinInterval)
+{
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory *config = new ConfigCategory("scale", info->config);
+	ASSERT_NE(config, (ConfigCategory *)NULL);
+	config->setItemsValueFromDefault();
+	ASSERT_EQ(config->itemExists("minInterval"), true);
+	config->setValue("factor", "2");
+	config->setValue("minInterval", "100");
+	config->setValue("enable", "true");
+	ReadingSet *outReadings;
+	void *handle = plugin_init(config, &outReadings, Handler);
+	vector<Reading *> *readings = new vector<Reading *>;
+
+	// Readings every 40ms, only those 100ms or more apart are kept
+	for (long i = 0; i < 8; i++)
+	{
+		DatapointValue dpv(i);
+		Reading *in = new Reading("test", new Datapoint("test", dpv));
+		struct timeval tm;
+		tm.tv_sec = 1000 + (i * 40) / 1000;
+		tm.tv_usec = ((i * 40) % 1000) * 1000;
+		in->setUserTimestamp(tm);
+		readings->push_back(in);
+	}
+
+	ReadingSet readingSet(readings);
+	plugin_ingest(handle, (READINGSET *)&readingSet);
+
+
+	vector<Reading *>results = outReadings->getAllReadings();
+	ASSERT_EQ(results.size(), 3);
+	ASSERT_EQ(results[0]->getReadingData()[0]->getData().toDouble(), 0.0);
+	ASSERT_EQ(results[1]->getReadingData()[0]->getData().toDouble(), 6.0);
+	ASSERT_EQ(results[2]->getReadingData()[0]->getData().toDouble(), 12.0);
+
+	// Gaps measured to the microsecond, 99.5ms is too short and 100ms is not
+	long usecs[] = { 1999500, 2099000, 2099500 };
+	readings = new vector<Reading *>;
+	for (long i = 0; i < 3; i++)
+	{
+		DatapointValue dpv(i);
+		Reading *in = new Reading("precise", new Datapoint("test", dpv));
+		struct timeval tm;
+		tm.tv_sec = usecs[i] / 1000000;
+		tm.tv_usec = usecs[i] % 1000000;
+		in->setUserTimestamp(tm);
+		readings->push_back(in);
+	}
+
+	ReadingSet preciseSet(readings);
+	plugin_ingest(handle, (READINGSET *)&preciseSet);
+
+	results = outReadings->getAllReadings();
+	ASSERT_EQ(results.size(), 2);
+	ASSERT_EQ(results[0]->getReadingData()[0]->getData().toDouble(), 0.0);
+	ASSERT_EQ(results[1]->getReadingData()[0]->getData().toDouble(), 4.0);
+}
+
+TEST(SCALE, ScaleDecimateBatches)
+{
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory *config = new ConfigCategory("scale", info->config);
+	ASSERT_NE(config, (ConfigCategory *)NULL);
+	config->setItemsValueFromDefault();
+	config->setValue("factor", "2");
+	config->setValue("decimation", "3");
+	config->setValue("minInterval", "100");
+	config->setValue("enable", "true");
+	ReadingSet *outReadings;
+	void *handle = plugin_init(config, &outReadings, Handler);
+
+	/*
+	 * Readings of one asset 40ms apart, split over batches. The
+	 * every third reading 120ms apart pattern carries on from one
+	 * batch to the next until the filter is reconfigured.
+	 */
+	long batches[][3] = { { 0, 1, 2 }, { 3, 4, 5 }, { 6, 7, -1 }, { 8, 9, 10 } };
+	double expected[][3] = { { 0.0, -1, -1 }, { 6.0, -1, -1 }, { 12.0, -1, -1 }, { 16.0, -1, -1 } };
+	for (int batch = 0; batch < 4; batch++)
+	{
+		if (batch == 3)
+		{
+			// Restart the counting and interval
+			plugin_reconfigure((PLUGIN_HANDLE *)handle, config->itemsToJSON());
+		}
+		vector<Reading *> *readings = new vector<Reading *>;
+		for (int i = 0; i < 3 && batches[batch][i] >= 0; i++)
+		{
+			long n = batches[batch][i];
+			// The first reading after the reconfigure is only 60ms after the last kept
+			long msecs = n < 8 ? n * 40 : 300 + (n - 8) * 40;
+			DatapointValue dpv(n);
+			Reading *in = new Reading("test", new Datapoint("test", dpv));
+			struct timeval tm;
+			tm.tv_sec = 1000 + msecs / 1000;
+			tm.tv_usec = (msecs % 1000) * 1000;
+			in->setUserTimestamp(tm);
+			readings->push_back(in);
+		}
+
+		ReadingSet readingSet(readings);
+		plugin_ingest(handle, (READINGSET *)&readingSet);
+
+		vector<Reading *>results = outReadings->getAllReadings();
+		int count = 0;
+		while (count < 3 && expected[batch][count] >= 0)
+			count++;
+		ASSERT_EQ(results.size(), count) << "batch " << batch;
+		for (int i = 0; i < count; i++)
+		{
+			ASSERT_EQ(results[i]->getReadingData()[0]->getData().toDouble(), expected[batch][i])
+				<< "batch " << batch;
+		}
+	}
+}
+
+TEST(SCALE, ScaleHighPrecision)
+{
+	// Integers beyond 2^53 that standard precision cannot scale exactly
+	long inputs[] = { 9007199254740993L, 2305843009213693953L, -9007199254740993L };
+
+	for (int mode = 0; mode < 2; mode++)
+	{
+		PLUGIN_INFORMATION *info = plugin_info();
+		ConfigCategory *config = new ConfigCategory("scale", info->config);
+		ASSERT_NE(config, (ConfigCategory *)NULL);
+		config->setItemsValueFromDefault();
+		ASSERT_EQ(config->itemExists("precision"), true);
+		config->setValue("factor", "3");
+		config->setValue("offset", "1");
+		config->setValue("enable", "true");
+		if (mode == 1)
+		{
+			config->setValue("precision", "High");
+		}
+		ReadingSet *outReadings;
+		void *handle = plugin_init(config, &outReadings, Handler);
+		vector<Reading *> *readings = new vector<Reading *>;
+
+		for (int i = 0; i < 3; i++)
+		{
+			DatapointValue dpv(inputs[i]);
+			readings->push_back(new Reading("test", new Datapoint("test", dpv)));
+		}
+
+		ReadingSet readingSet(readings);
+		plugin_ingest(handle, (READINGSET *)&readingSet);
+
+
+		vector<Reading *>results = outReadings->getAllReadings();
+		ASSERT_EQ(results.size(), 3);
+		for (int i = 0; i < 3; i++)
+		{
+			long exact = inputs[i] * 3 + 1;
+			DatapointValue& out = results[i]->getReadingData()[0]->getData();
+			if (mode == 0)
+			{
+				// Standard precision rounds through a double
+				ASSERT_EQ(out.getType(), DatapointValue::T_FLOAT);
+				long error = labs(exact - (long)out.toDouble());
+				ASSERT_GT(error, 0);
+				ASSERT_LE(error, 1024);
+			}
+			else
+			{
+				ASSERT_EQ(out.getType(), DatapointValue::T_INTEGER);
+				ASSERT_EQ(out.toInt(), exact);
+			}
+		}
+	}
+}
+
+TEST(SCALE, ScaleHighPrecisionFraction)
+{
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory *config = new ConfigCategory("scale", info->config);
+	ASSERT_NE(config, (ConfigCategory *)NULL);
+	config->setItemsValueFromDefault();
+	config->setValue("factor", "0.5");
+	config->setValue("offset", "0.25");
+	config->setValue("precision", "High");
+	config->setValue("enable", "true");
+	ReadingSet *outReadings;
+	void *handle = plugin_init(config, &outReadings, Handler);
+	vector<Reading *> *readings = new vector<Reading *>;
+
+	vector<Datapoint *> datapoints;
+	long longValue = 9;
+	DatapointValue dpv(longValue);
+	datapoints.push_back(new Datapoint("integer", dpv));
+	long otherValue = 10;
+	DatapointValue dpv1(otherValue);
+	datapoints.push_back(new Datapoint("other", dpv1));
+	double doubleValue = 5.5;
+	DatapointValue dpv2(doubleValue);
+	datapoints.push_back(new Datapoint("double", dpv2));
+	readings->push_back(new Reading("test", datapoints));
+
+	ReadingSet readingSet(readings);
+	plugin_ingest(handle, (READINGSET *)&readingSet);
+
+
+	vector<Reading *>results = outReadings->getAllReadings();
+	ASSERT_EQ(results.size(), 1);
+	vector<Datapoint *> points = results[0]->getReadingData();
+	ASSERT_EQ(points.size(), 3);
+	for (int i = 0; i < points.size(); i++)
+	{
+		Datapoint *outdp = points[i];
+		if (outdp->getName().compare("integer") == 0)
+		{
+			ASSERT_EQ(outdp->getData().getType(), DatapointValue::T_FLOAT);
+			ASSERT_EQ(outdp->getData().toDouble(), 4.75);
+		}
+		else if (outdp->getName().compare("other") == 0)
+		{
+			ASSERT_EQ(outdp->getData().getType(), DatapointValue::T_FLOAT);
+			ASSERT_EQ(outdp->getData().toDouble(), 5.25);
+		}
+		else if (outdp->getName().compare("double") == 0)
+		{
+			ASSERT_EQ(outdp->getData().getType(), DatapointValue::T_FLOAT);
+			ASSERT_EQ(outdp->getData().toDouble(), 3.0);
+		}
+	}
+}
+
+TEST(SCALE, ScaleAdaptive)
+{
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory *config = new ConfigCategory("scale", info->config);
+	ASSERT_NE(config, (ConfigCategory *)NULL);
+	config->setItemsValueFromDefault();
+	ASSERT_EQ(config->itemExists("adaptive"), true);
+	config->setValue("factor", "2");
+	config->setValue("offset", "1");
+	config->setValue("adaptive", "true");
+	config->setValue("enable", "true");
+	ReadingSet *outReadings;
+	void *handle = plugin_init(config, &outReadings, Handler);
+
+	// Enough batches for every strategy to be timed and then chosen
+	for (int batch = 0; batch < 8; batch++)
+	{
+		vector<Reading *> *readings = new vector<Reading *>;
+		for (long i = 0; i < 200; i++)
+		{
+			vector<Datapoint *> datapoints;
+			DatapointValue dpv(i);
+			datapoints.push_back(new Datapoint("integer", dpv));
+			double doubleValue = i + 0.5;
+			DatapointValue dpv1(doubleValue);
+			datapoints.push_back(new Datapoint("double", dpv1));
+			readings->push_back(new Reading("test", datapoints));
+		}
+
+		ReadingSet readingSet(readings);
+		plugin_ingest(handle, (READINGSET *)&readingSet);
+
+
+		vector<Reading *>results = outReadings->getAllReadings();
+		ASSERT_EQ(results.size(), 200);
+		for (int i = 0; i < results.size(); i++)
+		{
+			vector<Datapoint *> points = results[i]->getReadingData();
+			ASSERT_EQ(points.size(), 2);
+			ASSERT_EQ(points[0]->getData().getType(), DatapointValue::T_FLOAT);
+			ASSERT_EQ(points[0]->getData().toDouble(), i * 2.0 + 1);
+			ASSERT_EQ(points[1]->getData().getType(), DatapointValue::T_FLOAT);
+			ASSERT_EQ(points[1]->getData().toDouble(), i * 2.0 + 2);
+		}
+	}
+}